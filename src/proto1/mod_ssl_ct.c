@@ -24,7 +24,6 @@
  *   . proxy: an httpd child process validates SCTs from a server only on the
  *     first time the data is received; but it could fail once due to invalid
  *     timestamp and succeed later after time elapses; fixit!
- *   . server: shouldn't have to read file of server SCTs on every handshake
  *   . split mod_ssl_ct.c into more pieces
  *   . research: Is it possible to send an SCT that is outside of the known
  *     valid interval for the log?
@@ -51,6 +50,7 @@
 #include "apr_global_mutex.h"
 #include "apr_signal.h"
 #include "apr_strings.h"
+#include "apr_thread_proc.h"
 #include "apr_thread_rwlock.h"
 
 #include "apr_dbd.h"
@@ -73,9 +73,12 @@
 #include "mod_proxy.h"
 #include "mod_ssl.h"
 #include "mod_ssl_openssl.h"
+#include "mod_status.h"
 
 #include "ssl_ct_util.h"
+#include "ssl_ct_recorder.h"
 #include "ssl_ct_sct.h"
+#include "ssl_ct_stats.h"
 
 #include "openssl/x509v3.h"
 #include "openssl/ocsp.h"
@@ -109,6 +112,10 @@
  */
 #define MAX_LOGLIST_SIZE 1000
 
+/** Limit on size of the set of already-audited keys (1M keys)
+ */
+#define MAX_AUDITED_KEYS_SIZE (1024 * 1024 * SHA256_DIGEST_LENGTH)
+
 typedef struct ct_server_config {
     apr_array_header_t *db_log_config;
     apr_pool_t *db_log_config_pool;
@@ -145,10 +152,25 @@ typedef struct ct_conn_config {
 } ct_conn_config;
 
 typedef struct ct_server_cert_info {
+    X509 *cert;
     const char *fingerprint;
     const char *sct_dir;
 } ct_server_cert_info;
 
+/* In-memory copy of the collated SCTs for a server certificate.  These
+ * are loaded by the parent so that child processes share them until the
+ * daemon actually changes the SCTs, and handshakes don't read the disk.
+ */
+typedef struct ct_server_scts {
+    X509 *cert;              /* key in server_scts */
+    const char *fingerprint;
+    const char *collated_fn;
+    apr_time_t mtime;        /* of collated_fn when last read */
+    unsigned char *scts;     /* NULL if none are available yet */
+    apr_size_t scts_len;
+    int scts_malloced;       /* 0 if still the copy loaded by the parent */
+} ct_server_scts;
+
 typedef struct ct_sct_data {
     const void *data;
     apr_uint16_t len;
@@ -162,6 +184,9 @@ typedef struct ct_callback_info {
 
 typedef struct ct_cached_server_data {
     apr_status_t validation_result;
+    /* per-SCT results for the flight recorder, replayed on a cache hit */
+    unsigned char num_scts;
+    ctrec_sct scts[CTREC_MAX_SCTS];
 } ct_cached_server_data;
 
 /* the log configuration in use -- either db_log_config or static_log_config */
@@ -176,16 +201,37 @@ static apr_global_mutex_t *ssl_ct_sct_update;
 static int refresh_all_scts(server_rec *s_main, apr_pool_t *p,
                             apr_array_header_t *log_config);
 
+static void load_audited_keys(apr_pool_t *p, server_rec *s,
+                              const char *audit_storage);
+
 static apr_thread_t *service_thread;
 
 static apr_hash_t *cached_server_data;
 
 static const char *audit_fn_perm, *audit_fn_active;
+static const unsigned char *audited_keys; /* sorted binary keys */
+static apr_size_t num_audited_keys;
 static apr_file_t *audit_file;
 static int audit_file_nonempty;
 static apr_thread_mutex_t *audit_file_mutex;
 static apr_thread_mutex_t *cached_server_data_mutex;
 static apr_thread_rwlock_t *log_config_rwlock;
+static apr_pool_t *service_thread_pool;
+
+/* modification time, size, and config version (0 if unknown) of the
+ * log config DB when last read
+ */
+static apr_time_t log_config_mtime;
+static apr_off_t log_config_size;
+static apr_int64_t log_config_version;
+
+static apr_hash_t *server_scts; /* X509 * -> ct_server_scts * */
+static apr_thread_rwlock_t *server_scts_rwlock;
+
+#ifdef SIGUSR2
+/* set by signal handler; the service thread dumps the flight recorder */
+static volatile sig_atomic_t recorder_dump_requested;
+#endif
 
 #ifdef HAVE_SCT_DAEMON_CHILD
 
@@ -794,6 +840,227 @@ static apr_status_t refresh_scts_for_cert(server_rec *s, apr_pool_t *p,
     return rv;
 }
 
+/* Has the log config DB changed since it was last read?  The modification
+ * time and size are checked so that children can keep sharing the
+ * configuration parsed by the parent until an administrator changes it.
+ * (If the DB can't be examined, treat it as changed so that the failure
+ * to read it is reported.)
+ */
+static int log_config_db_changed(apr_pool_t *p, server_rec *s,
+                                 const char *fname)
+{
+    apr_finfo_t finfo;
+    apr_int64_t version;
+
+    if (apr_stat(&finfo, fname, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                 p) != APR_SUCCESS) {
+        log_config_mtime = 0;
+        return 1;
+    }
+
+    if (finfo.mtime == log_config_mtime && finfo.size == log_config_size) {
+        return 0;
+    }
+
+    log_config_mtime = finfo.mtime;
+    log_config_size = finfo.size;
+
+    /* The file can change without the log configuration changing, such
+     * as when SQLite reorganizes it; the config version of a schema
+     * version 2 DB changes only with the configuration.
+     */
+    if (log_config_version
+        && read_config_db_version(p, s, fname, &version) == APR_SUCCESS
+        && version == log_config_version) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Read the collated SCTs in sct_fn.  If mtime is non-NULL, the file is
+ * read only if its modification time differs from *mtime (otherwise
+ * *scts is set to NULL), and *mtime is updated after reading.
+ */
+static apr_status_t read_collated_scts(apr_pool_t *p, server_rec *s,
+                                       const char *sct_fn, apr_time_t *mtime,
+                                       char **scts, apr_size_t *scts_len)
+{
+    apr_finfo_t finfo;
+    apr_status_t rv, tmprv;
+
+    *scts = NULL;
+
+    if (mtime) {
+        /* The daemon removes the old file before renaming the new one
+         * into place, so this can fail briefly; the caller will try again.
+         */
+        rv = apr_stat(&finfo, sct_fn, APR_FINFO_MTIME, p);
+        if (rv != APR_SUCCESS || finfo.mtime == *mtime) {
+            return rv;
+        }
+    }
+
+    if ((rv = apr_global_mutex_lock(ssl_ct_sct_update)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "global mutex lock failed");
+        return rv;
+    }
+
+    if (mtime) {
+        /* the file may have been replaced since it was checked above */
+        rv = apr_stat(&finfo, sct_fn, APR_FINFO_MTIME, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = ctutil_read_file(p, s, sct_fn, MAX_SCTS_SIZE, scts, scts_len);
+    }
+
+    if ((tmprv = apr_global_mutex_unlock(ssl_ct_sct_update)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, tmprv, s,
+                     "global mutex unlock failed");
+    }
+
+    if (rv == APR_SUCCESS && mtime) {
+        *mtime = finfo.mtime;
+    }
+
+    return rv;
+}
+
+/* Load the collated SCTs and fingerprint of every server certificate
+ * before the children are created.  (SCTs which aren't available yet,
+ * such as when starting as root, are picked up later by each child's
+ * service thread.)
+ */
+static void load_server_scts(server_rec *s_main, apr_pool_t *p)
+{
+    server_rec *s;
+
+    server_scts = apr_hash_make(p);
+
+    for (s = s_main; s; s = s->next) {
+        ct_server_config *sconf = ap_get_module_config(s->module_config,
+                                                       &ssl_ct_module);
+        const ct_server_cert_info *cert_info_elts;
+        int i;
+
+        if (!sconf || !sconf->server_cert_info) {
+            continue;
+        }
+
+        cert_info_elts =
+            (const ct_server_cert_info *)sconf->server_cert_info->elts;
+        for (i = 0; i < sconf->server_cert_info->nelts; i++) {
+            ct_server_scts *info;
+            char *collated_fn, *scts;
+            apr_size_t scts_len;
+            apr_status_t rv;
+
+            if (apr_hash_get(server_scts, &cert_info_elts[i].cert,
+                             sizeof(X509 *))) {
+                continue;
+            }
+
+            rv = ctutil_path_join(&collated_fn, cert_info_elts[i].sct_dir,
+                                  COLLATED_SCTS_BASENAME, p, s_main);
+            if (rv != APR_SUCCESS) {
+                continue;
+            }
+
+            info = apr_pcalloc(p, sizeof *info);
+            info->cert = cert_info_elts[i].cert;
+            info->fingerprint = cert_info_elts[i].fingerprint;
+            info->collated_fn = collated_fn;
+
+            rv = read_collated_scts(p, s_main, collated_fn, &info->mtime,
+                                    &scts, &scts_len);
+            if (rv == APR_SUCCESS && scts) {
+                info->scts = (unsigned char *)scts;
+                info->scts_len = scts_len;
+            }
+
+            apr_hash_set(server_scts, &info->cert, sizeof info->cert, info);
+        }
+    }
+}
+
+/* Pick up SCTs that the daemon has changed since they were last read
+ * by this child.
+ */
+static void refresh_server_scts(apr_pool_t *p, server_rec *s)
+{
+    apr_hash_index_t *hi;
+
+    if (!server_scts) {
+        return;
+    }
+
+    for (hi = apr_hash_first(p, server_scts); hi; hi = apr_hash_next(hi)) {
+        ct_server_scts *info = apr_hash_this_val(hi);
+        apr_time_t mtime = info->mtime;
+        unsigned char *old_scts, *new_scts;
+        char *scts;
+        apr_size_t scts_len;
+        int old_malloced;
+
+        if (read_collated_scts(p, s, info->collated_fn, &mtime,
+                               &scts, &scts_len) != APR_SUCCESS
+            || !scts) {
+            continue;
+        }
+
+        /* The daemon rebuilds the file on every cycle, so it usually
+         * hasn't really changed.  Leave the existing copy alone in that
+         * case, since it may still be shared with the parent.
+         */
+        if (info->scts && info->scts_len == scts_len
+            && !memcmp(info->scts, scts, scts_len)) {
+            info->mtime = mtime;
+            continue;
+        }
+
+        new_scts = malloc(scts_len);
+        ap_assert(new_scts);
+        memcpy(new_scts, scts, scts_len);
+
+        ap_assert(apr_thread_rwlock_wrlock(server_scts_rwlock) == 0);
+        old_scts = info->scts;
+        old_malloced = info->scts_malloced;
+        info->scts = new_scts;
+        info->scts_len = scts_len;
+        info->scts_malloced = 1;
+        info->mtime = mtime;
+        ap_assert(apr_thread_rwlock_unlock(server_scts_rwlock) == 0);
+
+        if (old_malloced) {
+            free(old_scts);
+        }
+
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     SERVICE_THREAD_NAME " - loaded new SCTs from %s",
+                     info->collated_fn);
+    }
+}
+
+/* Copy the SCTs to send for a server certificate, since the service
+ * thread may replace them once the lock is released.
+ */
+static apr_status_t get_server_scts(apr_pool_t *p, ct_server_scts *info,
+                                    char **scts, apr_size_t *scts_len)
+{
+    apr_status_t rv = APR_ENOENT;
+
+    ap_assert(apr_thread_rwlock_rdlock(server_scts_rwlock) == 0);
+    if (info->scts) {
+        *scts = apr_pmemdup(p, info->scts, info->scts_len);
+        *scts_len = info->scts_len;
+        rv = APR_SUCCESS;
+    }
+    ap_assert(apr_thread_rwlock_unlock(server_scts_rwlock) == 0);
+
+    return rv;
+}
+
 static void *run_service_thread(apr_thread_t *me, void *data)
 {
     server_rec *s = data;
@@ -806,6 +1073,15 @@ static void *run_service_thread(apr_thread_t *me, void *data)
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                  SERVICE_THREAD_NAME " started");
 
+#ifdef SIGUSR2
+    /* The threaded MPMs block asynchronous signals in every thread of
+     * the child before the child_init hooks run, and this thread
+     * inherits that mask; make sure that the dump request is delivered
+     * here.
+     */
+    apr_signal_unblock(SIGUSR2);
+#endif
+
     while (1) {
         if ((rv = ap_mpm_query(AP_MPMQ_MPM_STATE, &mpmq_s)) != APR_SUCCESS) {
             break;
@@ -814,9 +1090,20 @@ static void *run_service_thread(apr_thread_t *me, void *data)
             break;
         }
         apr_sleep(apr_time_from_sec(1));
+#ifdef SIGUSR2
+        if (recorder_dump_requested) {
+            recorder_dump_requested = 0;
+            ctrec_dump_to_log(service_thread_pool, s);
+            apr_pool_clear(service_thread_pool);
+        }
+#endif
+        refresh_server_scts(service_thread_pool, s);
+        apr_pool_clear(service_thread_pool);
         if (++count >= 30) {
             count = 0;
-            if (sconf->db_log_config) {
+            if (sconf->db_log_config
+                && log_config_db_changed(service_thread_pool, s,
+                                         sconf->log_config_fname)) {
                 /* Reload log config DB */
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                              SERVICE_THREAD_NAME " - reloading config");
@@ -828,9 +1115,12 @@ static void *run_service_thread(apr_thread_t *me, void *data)
                                    sizeof(ct_log_config *));
                 rv = read_config_db(sconf->db_log_config_pool,
                                     s, sconf->log_config_fname,
-                                    sconf->db_log_config);
+                                    sconf->db_log_config,
+                                    &log_config_version);
                 ap_assert(apr_thread_rwlock_unlock(log_config_rwlock) == 0);
                 if (rv != APR_SUCCESS) {
+                    /* try again next time, even if the DB is unchanged */
+                    log_config_mtime = 0;
                     /* specific issue already logged */
                     ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s,
                                  SERVICE_THREAD_NAME " - no active configuration until "
@@ -863,7 +1153,10 @@ static void sct_daemon_cycle(ct_server_config *sconf, server_rec *s_main,
 {
     apr_status_t rv;
 
-    if (sconf->db_log_config) { /* not using static config */
+    if (sconf->db_log_config /* not using static config */
+        && (!active_log_config
+            || log_config_db_changed(ptemp, s_main,
+                                     sconf->log_config_fname))) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s_main,
                      "%s - reloading config", daemon_name);
         apr_pool_clear(sconf->db_log_config_pool);
@@ -873,7 +1166,7 @@ static void sct_daemon_cycle(ct_server_config *sconf, server_rec *s_main,
                            sizeof(ct_log_config *));
         rv = read_config_db(sconf->db_log_config_pool,
                             s_main, sconf->log_config_fname,
-                            sconf->db_log_config);
+                            sconf->db_log_config, &log_config_version);
         if (rv != APR_SUCCESS) {
             ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s_main,
                          "%s - no active configuration until "
@@ -1233,6 +1526,20 @@ static int ssl_ct_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     apr_pool_cleanup_register(pconf, (void *)s_main, ssl_ct_mutex_remove,
                               apr_pool_cleanup_null);
 
+    ctstats_init(pconf, s_main);
+
+    if (sconf->audit_storage) {
+        load_audited_keys(pconf, s_main, sconf->audit_storage);
+    }
+
+#ifdef SIGUSR2
+    /* Only the children act on a request to dump the flight recorder;
+     * don't let one sent to the parent (or the daemon) take down the
+     * server.
+     */
+    apr_signal(SIGUSR2, SIG_IGN);
+#endif
+
     if (sconf->log_config_fname) {
         if (!sconf->db_log_config) {
             /* log config db in separate pool that can be cleared */
@@ -1241,9 +1548,11 @@ static int ssl_ct_post_config(apr_pool_t *pconf, apr_pool_t *plog,
                 apr_array_make(sconf->db_log_config_pool, 2,
                                sizeof(ct_log_config *));
         }
+        log_config_version = 0;
+        (void)log_config_db_changed(ptemp, s_main, sconf->log_config_fname);
         rv = read_config_db(sconf->db_log_config_pool,
                             s_main, sconf->log_config_fname,
-                            sconf->db_log_config);
+                            sconf->db_log_config, &log_config_version);
         if (rv != APR_SUCCESS) {
             return HTTP_INTERNAL_SERVER_ERROR;
         }
@@ -1300,6 +1609,8 @@ static int ssl_ct_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     }
 #endif
 
+    load_server_scts(s_main, pconf);
+
 #ifdef HAVE_SCT_DAEMON_CHILD
     if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_CREATE_PRE_CONFIG) {
         int ret = daemon_start(pconf, s_main, procnew);
@@ -1375,7 +1686,7 @@ static apr_status_t read_scts(apr_pool_t *p, const char *fingerprint,
                               server_rec *s,
                               char **scts, apr_size_t *scts_len)
 {
-    apr_status_t rv, tmprv;
+    apr_status_t rv;
     char *cert_dir, *sct_fn;
 
     rv = ctutil_path_join(&cert_dir, sct_dir, fingerprint, p, s);
@@ -1388,20 +1699,7 @@ static apr_status_t read_scts(apr_pool_t *p, const char *fingerprint,
         return rv;
     }
 
-    if ((rv = apr_global_mutex_lock(ssl_ct_sct_update)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
-                     "global mutex lock failed");
-        return rv;
-    }
-
-    rv = ctutil_read_file(p, s, sct_fn, MAX_SCTS_SIZE, scts, scts_len);
-
-    if ((tmprv = apr_global_mutex_unlock(ssl_ct_sct_update)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, tmprv, s,
-                     "global mutex unlock failed");
-    }
-
-    return rv;
+    return read_collated_scts(p, s, sct_fn, NULL, scts, scts_len);
 }
 
 static void look_for_server_certs(server_rec *s, SSL_CTX *ctx, const char *sct_dir)
@@ -1470,6 +1768,7 @@ static void look_for_server_certs(server_rec *s, SSL_CTX *ctx, const char *sct_d
                          "wrote server cert and chain to %s", servercerts_pem);
 
             cert_info = (ct_server_cert_info *)apr_array_push(sconf->server_cert_info);
+            cert_info->cert = x;
             cert_info->sct_dir = cert_sct_dir;
             cert_info->fingerprint = fingerprint;
         }
@@ -1630,7 +1929,8 @@ static apr_status_t deserialize_SCTs(apr_pool_t *p,
  */
 static apr_status_t validate_server_data(apr_pool_t *p, conn_rec *c,
                                          cert_chain *cc, ct_conn_config *conncfg,
-                                         ct_server_config *sconf)
+                                         ct_server_config *sconf,
+                                         ctrec_entry *rec)
 {
     apr_status_t rv = APR_SUCCESS;
 
@@ -1715,9 +2015,12 @@ static apr_status_t validate_server_data(apr_pool_t *p, conn_rec *c,
                     rv = tmprv;
                 }
                 else {
+                    int stats_result = CTSTATS_SCT_VALID;
+
                     tmprv = sct_verify_timestamp(c, &fields);
                     if (tmprv != APR_SUCCESS) {
                         verification_failures++;
+                        stats_result = CTSTATS_SCT_INVALID;
                     }
 
                     if (active_log_config) {
@@ -1734,12 +2037,16 @@ static apr_status_t validate_server_data(apr_pool_t *p, conn_rec *c,
                             ap_log_cerror(APLOG_MARK, APLOG_WARNING, 0, c,
                                           "Server sent SCT from unrecognized log");
                             unknown_log_ids++;
+                            if (stats_result == CTSTATS_SCT_VALID) {
+                                stats_result = CTSTATS_SCT_UNKNOWN_LOG;
+                            }
                         }
                         else if (tmprv != APR_SUCCESS) {
                             ap_log_cerror(APLOG_MARK, APLOG_ERR, 0, c,
                                           "Server sent SCT with invalid signature");
                             tmprv = APR_EINVAL;
                             verification_failures++;
+                            stats_result = CTSTATS_SCT_INVALID;
                         }
                         else {
                             verification_successes++;
@@ -1750,7 +2057,12 @@ static apr_status_t validate_server_data(apr_pool_t *p, conn_rec *c,
                         ap_log_cerror(APLOG_MARK, APLOG_WARNING, 0, c,
                                       "Signature of SCT from server could not be "
                                       "verified (no configured log public keys)");
+                        if (stats_result == CTSTATS_SCT_VALID) {
+                            stats_result = CTSTATS_SCT_UNKNOWN_LOG;
+                        }
                     }
+                    ctstats_log_sct(fields.logid, stats_result);
+                    ctrec_add_sct(rec, fields.logid, stats_result);
                 }
                 sct_release(&fields);
             }
@@ -1885,6 +2197,92 @@ static void save_server_data(conn_rec *c, cert_chain *cc,
     }
 }
 
+/* The off-line audit (ctauditscts) publishes the keys of the server
+ * data it has already processed in file AUDITED_KEYS_BASENAME in the
+ * CTAuditStorage directory: the binary form of each key, sorted, with
+ * no other data.  Data which has already been audited isn't queued
+ * again.
+ */
+#define AUDITED_KEYS_BASENAME "audited.keys"
+
+/* Load the keys of server data which the off-line audit has already
+ * processed.  This is done in the parent, so that child processes share
+ * the keys; a new file is picked up at the next restart.
+ */
+static void load_audited_keys(apr_pool_t *p, server_rec *s,
+                              const char *audit_storage)
+{
+    apr_finfo_t finfo;
+    apr_size_t contents_size;
+    apr_status_t rv;
+    char *contents, *fn;
+
+    audited_keys = NULL;
+    num_audited_keys = 0;
+
+    rv = ctutil_path_join(&fn, audit_storage, AUDITED_KEYS_BASENAME, p, s);
+    if (rv != APR_SUCCESS || !ctutil_file_exists(p, fn)) {
+        return;
+    }
+
+    rv = apr_stat(&finfo, fn, APR_FINFO_SIZE, p);
+    if (rv == APR_SUCCESS && finfo.size > MAX_AUDITED_KEYS_SIZE) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "%s is larger than %d bytes; server data already "
+                     "audited will be saved for audit again (feedback from "
+                     "off-line audit disabled)",
+                     fn, MAX_AUDITED_KEYS_SIZE);
+        return;
+    }
+
+    rv = ctutil_read_file(p, s, fn, MAX_AUDITED_KEYS_SIZE, &contents,
+                          &contents_size);
+    if (rv != APR_SUCCESS) {
+        /* specific issue already logged */
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "feedback from off-line audit disabled");
+        return;
+    }
+
+    if (contents_size % SHA256_DIGEST_LENGTH) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "%s is corrupt (size %" APR_SIZE_T_FMT "), ignoring "
+                     "(feedback from off-line audit disabled)",
+                     fn, contents_size);
+        return;
+    }
+
+    audited_keys = (const unsigned char *)contents;
+    num_audited_keys = contents_size / SHA256_DIGEST_LENGTH;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "%" APR_SIZE_T_FMT " already audited keys loaded from %s",
+                 num_audited_keys, fn);
+}
+
+static int compare_audited_key(const void *key, const void *elt)
+{
+    return memcmp(key, elt, SHA256_DIGEST_LENGTH);
+}
+
+static int already_audited(const char *key)
+{
+    unsigned char bin_key[SHA256_DIGEST_LENGTH];
+    apr_size_t len;
+
+    if (!num_audited_keys || strlen(key) != 2 * sizeof bin_key) {
+        return 0;
+    }
+
+    if (apr_unescape_hex(bin_key, key, APR_ESCAPE_STRING, 0, &len)
+        != APR_SUCCESS) {
+        return 0;
+    }
+
+    return bsearch(bin_key, audited_keys, num_audited_keys,
+                   SHA256_DIGEST_LENGTH, compare_audited_key) != NULL;
+}
+
 /* signed_certificate_timestamp */
 static const unsigned short CT_EXTENSION_TYPE = 18;
 
@@ -2086,18 +2484,24 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
     apr_pool_t *p = c->pool;
     apr_status_t rv = APR_SUCCESS;
     const char *key;
-    ct_cached_server_data *cached;
+    ct_cached_server_data *cached = NULL;
     ct_conn_config *conncfg = get_conn_config(c);
     server_rec *s = c->base_server;
     ct_server_config *sconf = ap_get_module_config(s->module_config,
                                                    &ssl_ct_module);
-    int validation_error = 0, missing_sct_error = 0;
+    int validation_error = 0, missing_sct_error = 0, sources = 0, rc = OK;
+    int cache_hit = 0; /* validated earlier, not just by another thread */
+    apr_size_t sct_bytes = 0;
+    apr_time_t stage_start;
+    ctrec_entry rec;
     STACK_OF(X509) *chain = SSL_get_peer_cert_chain(ssl);
 
     if (sconf->proxy_awareness == PROXY_OBLIVIOUS) {
         return OK;
     }
 
+    ctrec_start(&rec, c, CTREC_TYPE_PROXY);
+
     ssl_ct_ssl_proxy_verify(s, c, chain);
 
     ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c,
@@ -2120,7 +2524,10 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
          * the same as before?
          */
         
+        stage_start = apr_time_now();
         key = gen_key(c, conncfg->certs, conncfg);
+        ctrec_stage_done(&rec, CTREC_STAGE_KEY, stage_start);
+        ctrec_key(&rec, key);
 
         ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c,
                       "key for server data: %s", key);
@@ -2135,8 +2542,13 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
             ct_cached_server_data *new_server_data =
                 (ct_cached_server_data *)calloc(1, sizeof(ct_cached_server_data));
 
+            stage_start = apr_time_now();
             new_server_data->validation_result = 
-                rv = validate_server_data(p, c, conncfg->certs, conncfg, sconf);
+                rv = validate_server_data(p, c, conncfg->certs, conncfg, sconf,
+                                          &rec);
+            ctrec_stage_done(&rec, CTREC_STAGE_SCTS, stage_start);
+            new_server_data->num_scts = rec.num_scts;
+            memcpy(new_server_data->scts, rec.scts, sizeof rec.scts);
 
             if (rv != APR_SUCCESS) {
                 validation_error = 1;
@@ -2162,12 +2574,22 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
             ctutil_thread_mutex_unlock(cached_server_data_mutex);
 
             if (rv == APR_SUCCESS && !cached) {
-                save_server_data(c, conncfg->certs, conncfg, key);
+                if (already_audited(key)) {
+                    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c,
+                                  "server data was already audited, "
+                                  "not saving it");
+                }
+                else {
+                    save_server_data(c, conncfg->certs, conncfg, key);
+                }
             }
         }
         else {
             /* cached */
+            cache_hit = 1;
             rv = cached->validation_result;
+            rec.num_scts = cached->num_scts;
+            memcpy(rec.scts, cached->scts, sizeof rec.scts);
             if (rv != APR_SUCCESS) {
                 validation_error = 1;
                 ap_log_cerror(APLOG_MARK, APLOG_INFO, rv, c, "bad cached validation result");
@@ -2184,6 +2606,32 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
         conncfg->certs = NULL;
     }
 
+    if (conncfg->cert_sct_list) {
+        sources |= CTSTATS_SRC_CERTEXT;
+        sct_bytes += conncfg->cert_sct_list_size;
+    }
+    if (conncfg->serverhello_sct_list) {
+        sources |= CTSTATS_SRC_TLSEXT;
+        sct_bytes += conncfg->serverhello_sct_list_size;
+    }
+    if (conncfg->ocsp_sct_list) {
+        sources |= CTSTATS_SRC_OCSP;
+        sct_bytes += conncfg->ocsp_sct_list_size;
+    }
+    ctstats_backend_handshake(c, sources, cache_hit, sct_bytes,
+                              validation_error);
+
+    rec.sources = (unsigned char)sources;
+    if (cache_hit) {
+        rec.flags |= CTREC_CACHE_HIT;
+    }
+    if (validation_error) {
+        rec.flags |= CTREC_FAILED;
+    }
+    if (missing_sct_error) {
+        rec.flags |= CTREC_NO_SCTS;
+    }
+
     ap_log_cerror(APLOG_MARK,
                   rv == APR_SUCCESS ? APLOG_DEBUG : APLOG_ERR, rv, c,
                   "SCT list received in: %s%s%s(%s) (c %pp)",
@@ -2197,11 +2645,15 @@ static int ssl_ct_proxy_post_handshake(conn_rec *c, SSL *ssl)
         if (missing_sct_error || validation_error) {
             ap_log_cerror(APLOG_MARK, APLOG_ERR, 0, c,
                           "Forbidding access to backend server; no valid SCTs");
-            return HTTP_FORBIDDEN;
+            rec.flags |= CTREC_FORBIDDEN;
+            rc = HTTP_FORBIDDEN;
         }
     }
 
-    return OK;
+    ctrec_stage_done(&rec, CTREC_STAGE_TOTAL, rec.time);
+    ctrec_commit(&rec);
+
+    return rc;
 }
 
 static int server_extension_callback_1(SSL *ssl, unsigned short ext_type,
@@ -2224,6 +2676,26 @@ static int server_extension_callback_1(SSL *ssl, unsigned short ext_type,
     return 1;
 }
 
+/* Note the logs of the SCTs being sent, for the flight recorder */
+static void record_sent_scts(ctrec_entry *rec, const unsigned char *scts,
+                             apr_size_t scts_len)
+{
+    const unsigned char *mem = scts, *list, *sct;
+    apr_size_t avail = scts_len, list_len, sct_len;
+
+    if (ctutil_read_var_bytes(&mem, &avail, &list, &list_len) != APR_SUCCESS) {
+        return;
+    }
+
+    while (list_len > 0
+           && ctutil_read_var_bytes(&list, &list_len, &sct,
+                                    &sct_len) == APR_SUCCESS) {
+        if (sct_len >= 1 + LOG_ID_SIZE) { /* version, then log id */
+            ctrec_add_sct(rec, sct + 1, CTREC_SCT_SENT);
+        }
+    }
+}
+
 static int server_extension_callback_2(SSL *ssl, unsigned short ext_type,
                                        const unsigned char **out,
                                        unsigned short *outlen, int *al,
@@ -2233,10 +2705,13 @@ static int server_extension_callback_2(SSL *ssl, unsigned short ext_type,
     ct_server_config *sconf = ap_get_module_config(c->base_server->module_config,
                                                    &ssl_ct_module);
     X509 *server_cert;
+    ct_server_scts *cert_scts;
     const char *fingerprint;
     const unsigned char *scts;
     apr_size_t scts_len;
     apr_status_t rv;
+    apr_time_t stage_start;
+    ctrec_entry rec;
 
     if (!is_client_ct_aware(c)) {
         /* Hmmm...  Is this actually called if the client doesn't include
@@ -2250,28 +2725,55 @@ static int server_extension_callback_2(SSL *ssl, unsigned short ext_type,
 
     /* need to reply with SCT */
 
+    ctrec_start(&rec, c, CTREC_TYPE_SERVER);
+
     server_cert = SSL_get_certificate(ssl); /* no need to free! */
-    fingerprint = get_cert_fingerprint(c->pool, server_cert);
+    cert_scts = server_scts ?
+        apr_hash_get(server_scts, &server_cert, sizeof server_cert) : NULL;
+    if (cert_scts) {
+        fingerprint = cert_scts->fingerprint;
+    }
+    else {
+        fingerprint = get_cert_fingerprint(c->pool, server_cert);
+    }
+    ctrec_stage_done(&rec, CTREC_STAGE_KEY, rec.time);
+    ctrec_key(&rec, fingerprint);
 
     ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c,
                   "server_extension_callback_2 called, "
                   "ext %hu will be in ServerHello",
                   ext_type);
 
-    rv = read_scts(c->pool, fingerprint,
-                   sconf->sct_storage,
-                   c->base_server, (char **)&scts, &scts_len);
+    stage_start = apr_time_now();
+    if (cert_scts) {
+        rv = get_server_scts(c->pool, cert_scts, (char **)&scts, &scts_len);
+    }
+    else {
+        /* not a certificate seen at startup */
+        rv = read_scts(c->pool, fingerprint,
+                       sconf->sct_storage,
+                       c->base_server, (char **)&scts, &scts_len);
+    }
+    ctrec_stage_done(&rec, CTREC_STAGE_SCTS, stage_start);
     if (rv == APR_SUCCESS) {
         *out = scts;
         ap_assert(scts_len <= USHRT_MAX);
         *outlen = (unsigned short)scts_len;
+        record_sent_scts(&rec, scts, scts_len);
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        /* the daemon hasn't obtained SCTs for this certificate (yet) */
+        rec.flags |= CTREC_NO_SCTS;
     }
     else {
-        /* Skip this extension for ServerHello */
-        return -1;
+        rec.flags |= CTREC_FAILED;
     }
 
-    return 1;
+    ctrec_stage_done(&rec, CTREC_STAGE_TOTAL, rec.time);
+    ctrec_commit(&rec);
+
+    /* if the SCTs couldn't be read, skip this extension for ServerHello */
+    return rv == APR_SUCCESS ? 1 : -1;
 }
 
 static void tlsext_cb(SSL *ssl, int client_server, int type,
@@ -2415,6 +2917,13 @@ static apr_status_t inactivate_audit_file(void *data)
     return APR_SUCCESS; /* what, you think anybody cares? */
 }
 
+#ifdef SIGUSR2
+static void recorder_signal_handler(int sig)
+{
+    recorder_dump_requested = 1;
+}
+#endif
+
 static void ssl_ct_child_init(apr_pool_t *p, server_rec *s)
 {
     apr_status_t rv;
@@ -2424,6 +2933,8 @@ static void ssl_ct_child_init(apr_pool_t *p, server_rec *s)
 
     cached_server_data = apr_hash_make(p);
 
+    ctrec_init(p, s);
+
     rv = apr_global_mutex_child_init(&ssl_ct_sct_update,
                                      apr_global_mutex_lockfile(ssl_ct_sct_update), p);
     if (rv != APR_SUCCESS) {
@@ -2443,6 +2954,20 @@ static void ssl_ct_child_init(apr_pool_t *p, server_rec *s)
         exit(APEXIT_CHILDSICK);
     }
 
+    rv = apr_thread_rwlock_create(&server_scts_rwlock, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                     "could not create rwlock in child");
+        exit(APEXIT_CHILDSICK);
+    }
+
+    /* for use only by the service thread */
+    apr_pool_create(&service_thread_pool, p);
+
+#ifdef SIGUSR2
+    apr_signal(SIGUSR2, recorder_signal_handler);
+#endif
+
     rv = apr_thread_create(&service_thread, NULL, run_service_thread, s, p);
     if (rv != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
@@ -2623,6 +3148,10 @@ static void ct_register_hooks(apr_pool_t *p)
                       NULL, NULL, APR_HOOK_MIDDLE);
     APR_OPTIONAL_HOOK(ssl, proxy_post_handshake, ssl_ct_proxy_post_handshake,
                       NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, ctstats_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, ctrec_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 }
 
 static const char *parse_num(apr_pool_t *p,
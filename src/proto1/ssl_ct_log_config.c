@@ -109,6 +109,30 @@ static apr_status_t read_public_key(apr_pool_t *p, const char *pubkey_fname,
     return APR_SUCCESS;
 }
 
+static apr_status_t decode_public_key(apr_pool_t *p, const unsigned char *der,
+                                      apr_size_t der_len, EVP_PKEY **ppkey)
+{
+    const unsigned char *tmp = der;
+    EVP_PKEY *pubkey;
+
+    *ppkey = NULL;
+
+    pubkey = d2i_PUBKEY(NULL, &tmp, (long)der_len);
+    if (!pubkey) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
+                     "d2i_PUBKEY() failed to process public key from log "
+                     "config db");
+        return APR_EINVAL;
+    }
+
+    *ppkey = pubkey;
+
+    apr_pool_cleanup_register(p, (void *)pubkey, public_key_cleanup,
+                              apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
 static void digest_public_key(EVP_PKEY *pubkey, unsigned char digest[LOG_ID_SIZE])
 {
     int len = i2d_PUBKEY(pubkey, NULL);
@@ -177,24 +201,26 @@ static apr_status_t parse_time_str(apr_pool_t *p, const char *time_str,
     return APR_SUCCESS;
 }
 
-/* The log_config array should have already been allocated from p. */
-apr_status_t save_log_config_entry(apr_array_header_t *log_config,
-                                   apr_pool_t *p,
-                                   const char *log_id,
-                                   const char *pubkey_fname,
-                                   const char *distrusted_str,
-                                   const char *min_time_str,
-                                   const char *max_time_str,
-                                   const char *url)
+/* Add an entry to log_config, which should have already been allocated
+ * from p.  log_id is the binary form of the log id; the caller has already
+ * checked that it matches the public key if both are provided.
+ */
+static apr_status_t add_log_config_entry(apr_array_header_t *log_config,
+                                         apr_pool_t *p,
+                                         const char *log_id,
+                                         EVP_PKEY *public_key,
+                                         const char *pubkey_fname,
+                                         const char *distrusted_str,
+                                         const char *min_time_str,
+                                         const char *max_time_str,
+                                         const char *url,
+                                         const char *operator_name)
 {
-    apr_size_t len;
     apr_status_t rv;
     apr_time_t min_time, max_time;
     apr_uri_t uri;
-    char *computed_log_id = NULL, *log_id_bin = NULL;
     ct_log_config *newconf, **pnewconf;
     int distrusted;
-    EVP_PKEY *public_key;
 
     if (!distrusted_str) {
         distrusted = DISTRUSTED_UNSET;
@@ -211,26 +237,6 @@ apr_status_t save_log_config_entry(apr_array_header_t *log_config,
         return APR_EINVAL;
     }
 
-    if (log_id) {
-        rv = apr_unescape_hex(NULL, log_id, strlen(log_id), 0, &len);
-        if (rv != 0 || len != 32) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
-                         "Log id \"%s\" not valid", log_id);
-            log_id_bin = apr_palloc(p, len);
-            apr_unescape_hex(log_id_bin, log_id, strlen(log_id), 0, NULL);
-        }
-    }
-
-    if (pubkey_fname) {
-        rv = read_public_key(p, pubkey_fname, &public_key);
-        if (rv != APR_SUCCESS) {
-            return rv;
-        }
-    }
-    else {
-        public_key = NULL;
-    }
-
     if (min_time_str) {
         rv = parse_time_str(p, min_time_str, &min_time);
         if (rv) {
@@ -268,11 +274,61 @@ apr_status_t save_log_config_entry(apr_array_header_t *log_config,
 
     newconf->distrusted = distrusted;
     newconf->public_key = public_key;
+    newconf->log_id = log_id;
 
-    if (newconf->public_key) {
+    newconf->min_valid_time = min_time;
+    newconf->max_valid_time = max_time;
+
+    newconf->url = url;
+    if (url) {
+        newconf->uri = uri;
+        newconf->uri_str = apr_uri_unparse(p, &uri, 0);
+    }
+    newconf->public_key_pem = pubkey_fname;
+    newconf->operator_name = operator_name;
+
+    return APR_SUCCESS;
+}
+
+/* The log_config array should have already been allocated from p. */
+apr_status_t save_log_config_entry(apr_array_header_t *log_config,
+                                   apr_pool_t *p,
+                                   const char *log_id,
+                                   const char *pubkey_fname,
+                                   const char *distrusted_str,
+                                   const char *min_time_str,
+                                   const char *max_time_str,
+                                   const char *url)
+{
+    apr_size_t len;
+    apr_status_t rv;
+    char *computed_log_id = NULL, *log_id_bin = NULL;
+    EVP_PKEY *public_key;
+
+    if (log_id) {
+        rv = apr_unescape_hex(NULL, log_id, strlen(log_id), 0, &len);
+        if (rv != 0 || len != LOG_ID_SIZE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
+                         "Log id \"%s\" not valid", log_id);
+            return APR_EINVAL;
+        }
+        log_id_bin = apr_palloc(p, len);
+        apr_unescape_hex(log_id_bin, log_id, strlen(log_id), 0, NULL);
+    }
+
+    if (pubkey_fname) {
+        rv = read_public_key(p, pubkey_fname, &public_key);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    else {
+        public_key = NULL;
+    }
+
+    if (public_key) {
         computed_log_id = apr_palloc(p, LOG_ID_SIZE);
-        digest_public_key(newconf->public_key,
-                          (unsigned char *)computed_log_id);
+        digest_public_key(public_key, (unsigned char *)computed_log_id);
     }
 
     if (computed_log_id && log_id_bin) {
@@ -283,34 +339,185 @@ apr_status_t save_log_config_entry(apr_array_header_t *log_config,
         }
     }
 
-    newconf->log_id = log_id_bin ? log_id_bin : computed_log_id;
+    return add_log_config_entry(log_config, p,
+                                log_id_bin ? log_id_bin : computed_log_id,
+                                public_key, pubkey_fname, distrusted_str,
+                                min_time_str, max_time_str, url, NULL);
+}
 
-    newconf->min_valid_time = min_time;
-    newconf->max_valid_time = max_time;
+/* Save an entry from a schema version 2 db, where the log id and public
+ * key were selected in hex.  ctlogconfig computes the log id whenever
+ * it stores a public key, so the key doesn't need to be digested here.
+ */
+static apr_status_t save_db_v2_entry(apr_array_header_t *log_config,
+                                     apr_pool_t *p,
+                                     const char *log_id_hex,
+                                     const char *public_key_hex,
+                                     const char *distrusted_str,
+                                     const char *min_time_str,
+                                     const char *max_time_str,
+                                     const char *url,
+                                     const char *operator_name)
+{
+    apr_size_t len;
+    apr_status_t rv;
+    const char *log_id = NULL;
+    const unsigned char *der;
+    char *computed_log_id;
+    EVP_PKEY *public_key = NULL;
+
+    if (log_id_hex) {
+        log_id = apr_punescape_hex(p, log_id_hex, 0, &len);
+        if (!log_id || len != LOG_ID_SIZE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
+                         "Log id \"%s\" not valid", log_id_hex);
+            return APR_EINVAL;
+        }
+    }
 
-    newconf->url = url;
-    if (url) {
-        newconf->uri = uri;
-        newconf->uri_str = apr_uri_unparse(p, &uri, 0);
+    if (public_key_hex) {
+        der = apr_punescape_hex(p, public_key_hex, 0, &len);
+        if (!der) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
+                         "Public key for log id \"%s\" not valid",
+                         log_id_hex ? log_id_hex : "(unset)");
+            return APR_EINVAL;
+        }
+        rv = decode_public_key(p, der, len, &public_key);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (!log_id) {
+            computed_log_id = apr_palloc(p, LOG_ID_SIZE);
+            digest_public_key(public_key, (unsigned char *)computed_log_id);
+            log_id = computed_log_id;
+        }
+    }
+
+    return add_log_config_entry(log_config, p, log_id, public_key, NULL,
+                                distrusted_str, min_time_str, max_time_str,
+                                url, operator_name);
+}
+
+/* Determine the schema version of an open log config db, and the config
+ * version for schema version 2 (0 otherwise).
+ */
+static apr_status_t get_db_version(const apr_dbd_driver_t *driver,
+                                   apr_pool_t *p, apr_dbd_t *handle,
+                                   server_rec *s_main,
+                                   const char *log_config_fname,
+                                   int *schema_version,
+                                   apr_int64_t *config_version)
+{
+    apr_dbd_results_t *res;
+    apr_dbd_row_t *row;
+    const char *schema_str, *version_str;
+    int rc;
+
+    /* There's no dbinfo table before schema version 2.  Any other failure
+     * (such as a locked db) must not cause a later schema to be read as
+     * version 1.
+     */
+    res = NULL;
+    rc = apr_dbd_select(driver, p, handle, &res,
+                        "SELECT name FROM sqlite_master "
+                        "WHERE type = 'table' AND name = 'dbinfo'", 0);
+    if (rc != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_main,
+                     "Can't determine the schema version of %s: %s",
+                     log_config_fname, apr_dbd_error(driver, handle, rc));
+        return APR_EINVAL;
+    }
+    if (apr_dbd_get_row(driver, p, res, &row, -1) != APR_SUCCESS) {
+        *schema_version = 1;
+        *config_version = 0;
+        return APR_SUCCESS;
+    }
+
+    res = NULL;
+    rc = apr_dbd_select(driver, p, handle, &res,
+                        "SELECT schema_version, config_version FROM dbinfo",
+                        0);
+    if (rc != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_main,
+                     "SELECT of dbinfo record from %s failed: %s",
+                     log_config_fname, apr_dbd_error(driver, handle, rc));
+        return APR_EINVAL;
+    }
+
+    if (apr_dbd_get_row(driver, p, res, &row, -1) != APR_SUCCESS
+        || !(schema_str = apr_dbd_get_entry(driver, row, 0))
+        || !(version_str = apr_dbd_get_entry(driver, row, 1))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_main,
+                     "Version information missing from %s",
+                     log_config_fname);
+        return APR_EINVAL;
+    }
+
+    *schema_version = atoi(schema_str);
+    *config_version = apr_atoi64(version_str);
+
+    if (*schema_version < 2 || *schema_version > LOG_CONFIG_SCHEMA_VERSION) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_main,
+                     "Schema version %s of %s is not supported",
+                     schema_str, log_config_fname);
+        return APR_EINVAL;
     }
-    newconf->public_key_pem = pubkey_fname;
 
     return APR_SUCCESS;
 }
 
+apr_status_t read_config_db_version(apr_pool_t *p, server_rec *s_main,
+                                    const char *log_config_fname,
+                                    apr_int64_t *config_version)
+{
+    apr_status_t rv;
+    const apr_dbd_driver_t *driver;
+    apr_dbd_t *handle;
+    int schema_version;
+
+    rv = apr_dbd_get_driver(p, "sqlite3", &driver);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s_main,
+                     "APR SQLite3 driver can't be loaded");
+        return rv;
+    }
+
+    rv = apr_dbd_open(driver, p, log_config_fname, &handle);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s_main,
+                     "Can't open SQLite3 db %s", log_config_fname);
+        return rv;
+    }
+
+    rv = get_db_version(driver, p, handle, s_main, log_config_fname,
+                        &schema_version, config_version);
+
+    apr_dbd_close(driver, handle);
+
+    return rv;
+}
+
+/* *config_version is set to the config version of a schema version 2
+ * db, or to 0 if the version is unknown or the db couldn't be read.
+ */
 apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
                             const char *log_config_fname,
-                            apr_array_header_t *log_config)
+                            apr_array_header_t *log_config,
+                            apr_int64_t *config_version)
 {
     apr_status_t rv;
     const apr_dbd_driver_t *driver;
     apr_dbd_t *handle;
     apr_dbd_results_t *res;
     apr_dbd_row_t *row;
-    int rc;
+    apr_int64_t version;
+    int rc, schema_version;
 
     ap_assert(log_config);
 
+    *config_version = 0;
+
     rv = apr_dbd_get_driver(p, "sqlite3", &driver);
     if (rv != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s_main,
@@ -325,9 +532,30 @@ apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
         return rv;
     }
 
+    /* The version is read before the log configuration, so if the
+     * configuration changes in between, the next check for a new
+     * version will just cause it to be read again.
+     */
+    rv = get_db_version(driver, p, handle, s_main, log_config_fname,
+                        &schema_version, &version);
+    if (rv != APR_SUCCESS) {
+        apr_dbd_close(driver, handle);
+        return rv;
+    }
+
     res = NULL;
-    rc = apr_dbd_select(driver, p, handle, &res,
-                        "SELECT * FROM loginfo", 0);
+    if (schema_version == 1) {
+        rc = apr_dbd_select(driver, p, handle, &res,
+                            "SELECT * FROM loginfo", 0);
+    }
+    else {
+        /* the driver can only return text, so get the blobs in hex */
+        rc = apr_dbd_select(driver, p, handle, &res,
+                            "SELECT id, hex(log_id), hex(public_key), "
+                            "distrusted, min_valid_timestamp, "
+                            "max_valid_timestamp, url, operator "
+                            "FROM loginfo", 0);
+    }
 
     if (rc != 0) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_main,
@@ -349,6 +577,7 @@ apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
                      "Log configuration in %s is empty",
                      log_config_fname);
         apr_dbd_close(driver, handle);
+        *config_version = version;
         return APR_SUCCESS;
     default:
         /* quiet some lints */
@@ -366,20 +595,49 @@ apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
         const char *min_timestamp = apr_dbd_get_entry(driver, row, cur++);
         const char *max_timestamp = apr_dbd_get_entry(driver, row, cur++);
         const char *url = apr_dbd_get_entry(driver, row, cur++);
-
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s_main,
-                     "Log config: Record %s, log id %s, public key file %s, distrusted %s, URL %s, time %s->%s",
-                     id,
-                     log_id ? log_id : "(unset)",
-                     public_key ? public_key : "(unset)",
-                     distrusted ? distrusted : "(unset, defaults to trusted)",
-                     url ? url : "(unset)",
-                     min_timestamp ? min_timestamp : "-INF",
-                     max_timestamp ? max_timestamp : "+INF");
-
-        rv = save_log_config_entry(log_config, p, log_id,
-                                   public_key, distrusted, 
-                                   min_timestamp, max_timestamp, url);
+        const char *operator_name = NULL;
+
+        if (schema_version == 1) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s_main,
+                         "Log config: Record %s, log id %s, public key file %s, distrusted %s, URL %s, time %s->%s",
+                         id,
+                         log_id ? log_id : "(unset)",
+                         public_key ? public_key : "(unset)",
+                         distrusted ? distrusted : "(unset, defaults to trusted)",
+                         url ? url : "(unset)",
+                         min_timestamp ? min_timestamp : "-INF",
+                         max_timestamp ? max_timestamp : "+INF");
+
+            rv = save_log_config_entry(log_config, p, log_id,
+                                       public_key, distrusted, 
+                                       min_timestamp, max_timestamp, url);
+        }
+        else {
+            operator_name = apr_dbd_get_entry(driver, row, cur++);
+
+            /* hex() of NULL is an empty string */
+            if (log_id && !*log_id) {
+                log_id = NULL;
+            }
+            if (public_key && !*public_key) {
+                public_key = NULL;
+            }
+
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s_main,
+                         "Log config: Record %s, log id %s, public key %s, operator %s, distrusted %s, URL %s, time %s->%s",
+                         id,
+                         log_id ? log_id : "(unset)",
+                         public_key ? "(set)" : "(unset)",
+                         operator_name ? operator_name : "(unset)",
+                         distrusted ? distrusted : "(unset, defaults to trusted)",
+                         url ? url : "(unset)",
+                         min_timestamp ? min_timestamp : "-INF",
+                         max_timestamp ? max_timestamp : "+INF");
+
+            rv = save_db_v2_entry(log_config, p, log_id, public_key,
+                                  distrusted, min_timestamp, max_timestamp,
+                                  url, operator_name);
+        }
         if (rv != APR_SUCCESS) {
             apr_dbd_close(driver, handle);
             return rv;
@@ -388,6 +646,8 @@ apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
 
     apr_dbd_close(driver, handle);
 
+    *config_version = version;
+
     return APR_SUCCESS;
 }
 
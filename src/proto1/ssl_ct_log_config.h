@@ -32,14 +32,27 @@ typedef struct ct_log_config {
     const char *url;
     const char *uri_str;
     apr_uri_t uri;
+    const char *operator_name;
 } ct_log_config;
 
+/* Schema version 1 of the log config db stores the log id in hex and the
+ * name of a PEM file for the public key; version 2 stores the binary log
+ * id and DER public key, along with a config version which ctlogconfig
+ * increments whenever the log configuration changes.
+ */
+#define LOG_CONFIG_SCHEMA_VERSION 2
+
 int log_config_readable(apr_pool_t *p, const char *logconfig,
                         const char **msg);
 
 apr_status_t read_config_db(apr_pool_t *p, server_rec *s_main,
                             const char *log_config_fname,
-                            apr_array_header_t *log_config);
+                            apr_array_header_t *log_config,
+                            apr_int64_t *config_version);
+
+apr_status_t read_config_db_version(apr_pool_t *p, server_rec *s_main,
+                                    const char *log_config_fname,
+                                    apr_int64_t *config_version);
 
 apr_status_t save_log_config_entry(apr_array_header_t *log_config,
                                    apr_pool_t *p,
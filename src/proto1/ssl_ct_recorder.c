@@ -0,0 +1,248 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Flight recorder: a fixed-size ring of compact records describing
+ * recent CT decisions made by this child process, so that a sudden
+ * change in behavior (backends forbidden, slow handshakes) can be
+ * diagnosed after the fact without running with trace logging.
+ *
+ * Writers claim a slot by atomically incrementing the ring index; the
+ * slot's sequence number is zero while the record is being copied in
+ * and is set to index + 1 afterwards.  Readers skip slots whose
+ * sequence number doesn't match or changes while they copy the record,
+ * so no lock is needed on either side.  Records are in process memory;
+ * each child has its own ring.
+ */
+
+#include <limits.h>
+
+#include "apr_atomic.h"
+#include "apr_escape.h"
+#include "apr_strings.h"
+
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "httpd.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "mod_status.h"
+
+#include "ssl_ct_recorder.h"
+#include "ssl_ct_stats.h"
+
+APLOG_USE_MODULE(ssl_ct);
+
+/** Number of records kept by each child process (must be a power of 2)
+ */
+#define CTREC_RING_SIZE 1024
+
+typedef struct ctrec_slot {
+    volatile apr_uint32_t seq;
+    ctrec_entry e;
+} ctrec_slot;
+
+static ctrec_slot *ring;
+static volatile apr_uint32_t ring_next;
+
+void ctrec_init(apr_pool_t *p, server_rec *s)
+{
+    ring = apr_pcalloc(p, CTREC_RING_SIZE * sizeof(ctrec_slot));
+    ring_next = 0;
+}
+
+void ctrec_start(ctrec_entry *e, conn_rec *c, int type)
+{
+    memset(e, 0, sizeof *e);
+    e->time = apr_time_now();
+    e->conn_id = c->id;
+    e->type = (unsigned char)type;
+}
+
+void ctrec_key(ctrec_entry *e, const char *key)
+{
+    /* not necessarily '\0'-terminated */
+    strncpy(e->key, key, sizeof e->key);
+}
+
+void ctrec_add_sct(ctrec_entry *e, const unsigned char *log_id, int result)
+{
+    if (e->num_scts < CTREC_MAX_SCTS) {
+        memcpy(e->scts[e->num_scts].log_id, log_id, CTREC_LOG_ID_PREFIX);
+        e->scts[e->num_scts].result = (unsigned char)result;
+    }
+    if (e->num_scts < UCHAR_MAX) {
+        e->num_scts++;
+    }
+}
+
+void ctrec_stage_done(ctrec_entry *e, int stage, apr_time_t start)
+{
+    e->usec[stage] = (apr_uint32_t)(apr_time_now() - start);
+}
+
+void ctrec_commit(ctrec_entry *e)
+{
+    apr_uint32_t idx;
+    ctrec_slot *slot;
+
+    if (!ring) { /* not initialized in this process */
+        return;
+    }
+
+    idx = apr_atomic_inc32(&ring_next);
+    slot = &ring[idx & (CTREC_RING_SIZE - 1)];
+    apr_atomic_set32(&slot->seq, 0);
+    slot->e = *e;
+    apr_atomic_set32(&slot->seq, idx + 1);
+}
+
+static const char *result_str(unsigned char result)
+{
+    switch (result) {
+    case CTSTATS_SCT_VALID:
+        return "valid";
+    case CTSTATS_SCT_INVALID:
+        return "INVALID";
+    case CTSTATS_SCT_UNKNOWN_LOG:
+        return "unknown-log";
+    case CTREC_SCT_SENT:
+        return "sent-not-verified";
+    default:
+        return "?";
+    }
+}
+
+static const char *format_entry(apr_pool_t *p, const ctrec_entry *e)
+{
+    char timestr[APR_RFC822_DATE_LEN];
+    const char *scts = "";
+    const char *key_end = memchr(e->key, '\0', sizeof e->key);
+    int i;
+
+    apr_rfc822_date(timestr, e->time);
+
+    for (i = 0; i < e->num_scts && i < CTREC_MAX_SCTS; i++) {
+        scts = apr_pstrcat(p, scts, " ",
+                           apr_pescape_hex(p, e->scts[i].log_id,
+                                           CTREC_LOG_ID_PREFIX, 0),
+                           ":", result_str(e->scts[i].result), NULL);
+    }
+
+    return apr_psprintf(p, "%s (+%06" APR_TIME_T_FMT "us) %s conn %ld "
+                        "key %.*s%s%s%s%s sources %s%s%s "
+                        "scts %d [%s ] usec key %u scts %u total %u",
+                        timestr, e->time % APR_USEC_PER_SEC,
+                        e->type == CTREC_TYPE_PROXY ? "proxy" : "server",
+                        e->conn_id,
+                        key_end ? (int)(key_end - e->key) : (int)sizeof e->key,
+                        e->key,
+                        e->flags & CTREC_CACHE_HIT ? " cache-hit" : "",
+                        e->flags & CTREC_FAILED ? " FAILED" : "",
+                        e->flags & CTREC_NO_SCTS ? " no-scts" : "",
+                        e->flags & CTREC_FORBIDDEN ? " FORBIDDEN" : "",
+                        e->sources & CTSTATS_SRC_CERTEXT ? "certext," : "",
+                        e->sources & CTSTATS_SRC_TLSEXT ? "tlsext," : "",
+                        e->sources & CTSTATS_SRC_OCSP ? "ocsp," : "",
+                        e->num_scts, scts,
+                        e->usec[CTREC_STAGE_KEY],
+                        e->usec[CTREC_STAGE_SCTS],
+                        e->usec[CTREC_STAGE_TOTAL]);
+}
+
+/* Copy out the current contents of the ring, oldest first, skipping
+ * any record which is being overwritten.
+ */
+static apr_array_header_t *snapshot(apr_pool_t *p)
+{
+    apr_array_header_t *arr = apr_array_make(p, CTREC_RING_SIZE,
+                                             sizeof(ctrec_entry));
+    apr_uint32_t next, idx;
+
+    if (!ring) {
+        return arr;
+    }
+
+    next = apr_atomic_read32(&ring_next);
+    idx = next > CTREC_RING_SIZE ? next - CTREC_RING_SIZE : 0;
+
+    for (; idx != next; idx++) {
+        ctrec_slot *slot = &ring[idx & (CTREC_RING_SIZE - 1)];
+        apr_uint32_t seq = apr_atomic_read32(&slot->seq);
+        ctrec_entry e;
+
+        if (seq != idx + 1) {
+            continue;
+        }
+        e = slot->e;
+        if (apr_atomic_read32(&slot->seq) != seq) {
+            continue;
+        }
+        *(ctrec_entry *)apr_array_push(arr) = e;
+    }
+
+    return arr;
+}
+
+void ctrec_dump_to_log(apr_pool_t *p, server_rec *s)
+{
+    apr_array_header_t *arr = snapshot(p);
+    const ctrec_entry *elts = (const ctrec_entry *)arr->elts;
+    int i;
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                 "CT flight recorder: %d records", arr->nelts);
+    for (i = 0; i < arr->nelts; i++) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "CT flight recorder: %s", format_entry(p, &elts[i]));
+    }
+}
+
+int ctrec_status_hook(request_rec *r, int flags)
+{
+    apr_array_header_t *arr;
+    const ctrec_entry *elts;
+    int i;
+
+    /* The ring can be long, so it is only displayed on request, as in
+     * /server-status?ctrecorder
+     */
+    if (!r->args || !strstr(r->args, "ctrecorder")) {
+        return OK;
+    }
+
+    arr = snapshot(r->pool);
+    elts = (const ctrec_entry *)arr->elts;
+
+    if (flags & AP_STATUS_SHORT) {
+        for (i = 0; i < arr->nelts; i++) {
+            ap_rprintf(r, "CTRecord: %s\n", format_entry(r->pool, &elts[i]));
+        }
+        return OK;
+    }
+
+    ap_rprintf(r, "<hr>\n<h2>Certificate Transparency flight recorder "
+               "(process %" APR_PID_T_FMT ", %d records)</h2>\n<pre>\n",
+               getpid(), arr->nelts);
+    for (i = 0; i < arr->nelts; i++) {
+        ap_rprintf(r, "%s\n",
+                   ap_escape_html(r->pool, format_entry(r->pool, &elts[i])));
+    }
+    ap_rputs("</pre>\n", r);
+
+    return OK;
+}
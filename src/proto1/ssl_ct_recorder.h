@@ -0,0 +1,79 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SSL_CT_RECORDER_H
+#define SSL_CT_RECORDER_H
+
+#include "httpd.h"
+
+#define CTREC_MAX_SCTS       4 /* per record; any more are only counted */
+#define CTREC_LOG_ID_PREFIX  8 /* bytes of log id kept for each SCT */
+#define CTREC_KEY_PREFIX     8 /* chars of key/fingerprint kept */
+
+#define CTREC_TYPE_SERVER    1 /* server_extension_callback_2 */
+#define CTREC_TYPE_PROXY     2 /* ssl_ct_proxy_post_handshake */
+
+/* flags */
+#define CTREC_CACHE_HIT      0x01
+#define CTREC_FAILED         0x02 /* SCTs invalid, or couldn't be read */
+#define CTREC_NO_SCTS        0x04 /* none received, or none to send */
+#define CTREC_FORBIDDEN      0x08 /* proxy refused the backend */
+
+/* result of an SCT sent by the server, which isn't verified (others are
+ * CTSTATS_SCT_xxx)
+ */
+#define CTREC_SCT_SENT       0xff
+
+/* stages for which elapsed time is recorded */
+#define CTREC_STAGE_KEY      0 /* key or certificate fingerprint */
+#define CTREC_STAGE_SCTS     1 /* read SCTs to send, or validate SCTs */
+#define CTREC_STAGE_TOTAL    2
+#define CTREC_NUM_STAGES     3
+
+typedef struct ctrec_sct {
+    unsigned char log_id[CTREC_LOG_ID_PREFIX];
+    unsigned char result; /* CTSTATS_SCT_xxx or CTREC_SCT_SENT */
+} ctrec_sct;
+
+typedef struct ctrec_entry {
+    apr_time_t time;
+    long conn_id;
+    char key[CTREC_KEY_PREFIX];
+    unsigned char type;
+    unsigned char flags;
+    unsigned char sources; /* CTSTATS_SRC_xxx */
+    unsigned char num_scts;
+    apr_uint32_t usec[CTREC_NUM_STAGES];
+    ctrec_sct scts[CTREC_MAX_SCTS];
+} ctrec_entry;
+
+void ctrec_init(apr_pool_t *p, server_rec *s);
+
+void ctrec_start(ctrec_entry *e, conn_rec *c, int type);
+
+void ctrec_key(ctrec_entry *e, const char *key);
+
+void ctrec_add_sct(ctrec_entry *e, const unsigned char *log_id, int result);
+
+void ctrec_stage_done(ctrec_entry *e, int stage, apr_time_t start);
+
+void ctrec_commit(ctrec_entry *e);
+
+void ctrec_dump_to_log(apr_pool_t *p, server_rec *s);
+
+int ctrec_status_hook(request_rec *r, int flags);
+
+#endif /* SSL_CT_RECORDER_H */
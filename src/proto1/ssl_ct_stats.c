@@ -0,0 +1,402 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Proxy statistics, maintained in a shared memory table created by
+ * the parent before the children are forked.  Every child updates the
+ * counters in place with atomic operations, so there is no locking on
+ * the handshake path and the status handler in any child can display
+ * the totals for the whole server.
+ *
+ * Backends and logs are assigned a slot the first time they are seen;
+ * slots are never released until the next restart.  When two children
+ * see a new backend at the same moment it can end up with two slots,
+ * which is harmless (it just shows up twice in the report).
+ */
+
+#include "apr_atomic.h"
+#include "apr_escape.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_version.h"
+
+#include "httpd.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "mod_status.h"
+
+#include "ssl_ct_sct.h"
+#include "ssl_ct_stats.h"
+
+APLOG_USE_MODULE(ssl_ct);
+
+/** Limit on number of distinct backend servers (address and port)
+ * which are tracked; handshakes with other backends are only counted
+ * in the overflow counter
+ */
+#define CTSTATS_MAX_BACKENDS 64
+
+/** Limit on number of distinct logs which are tracked
+ */
+#define CTSTATS_MAX_LOGS     32
+
+#define CTSTATS_NAME_LEN     64 /* big enough for "IPv6-address:port" */
+
+#define SLOT_FREE    0
+#define SLOT_CLAIMED 1 /* another process is filling in the key */
+#define SLOT_READY   2
+
+/* The counters are 64 bits, since a busy proxy would wrap a 32-bit
+ * handshake count in weeks and a 32-bit count of SCT bytes in minutes.
+ * 64-bit atomics are new in APR 1.7; with older APR the carry into the
+ * high word is done by hand, so a reader can briefly see a total which
+ * is short by 2^32 while another process is in the middle of carrying.
+ */
+#if APR_VERSION_AT_LEAST(1,7,0)
+typedef volatile apr_uint64_t ctstats_counter;
+
+static void counter_add(ctstats_counter *c, apr_uint32_t val)
+{
+    apr_atomic_add64(c, val);
+}
+
+static apr_uint64_t counter_read(ctstats_counter *c)
+{
+    return apr_atomic_read64(c);
+}
+#else
+typedef struct {
+    volatile apr_uint32_t hi;
+    volatile apr_uint32_t lo;
+} ctstats_counter;
+
+static void counter_add(ctstats_counter *c, apr_uint32_t val)
+{
+    apr_uint32_t old = apr_atomic_add32(&c->lo, val);
+
+    if (old + val < old) { /* low word wrapped */
+        apr_atomic_inc32(&c->hi);
+    }
+}
+
+static apr_uint64_t counter_read(ctstats_counter *c)
+{
+    apr_uint32_t hi, lo;
+
+    do {
+        hi = apr_atomic_read32(&c->hi);
+        lo = apr_atomic_read32(&c->lo);
+    } while (hi != apr_atomic_read32(&c->hi));
+
+    return ((apr_uint64_t)hi << 32) | lo;
+}
+#endif
+
+typedef struct ctstats_backend {
+    volatile apr_uint32_t state;
+    char name[CTSTATS_NAME_LEN];
+    ctstats_counter handshakes;
+    ctstats_counter cache_hits;
+    ctstats_counter no_scts;
+    ctstats_counter certext;
+    ctstats_counter tlsext;
+    ctstats_counter ocsp;
+    ctstats_counter validation_failures;
+    ctstats_counter sct_bytes;
+} ctstats_backend;
+
+typedef struct ctstats_log {
+    volatile apr_uint32_t state;
+    unsigned char log_id[LOG_ID_SIZE];
+    ctstats_counter scts[CTSTATS_SCT_NUM_RESULTS];
+} ctstats_log;
+
+typedef struct ctstats_table {
+    apr_time_t started;
+    ctstats_counter backend_overflow;
+    ctstats_counter log_overflow;
+    ctstats_backend backends[CTSTATS_MAX_BACKENDS];
+    ctstats_log logs[CTSTATS_MAX_LOGS];
+} ctstats_table;
+
+static ctstats_table *stats;
+
+void ctstats_init(apr_pool_t *p, server_rec *s)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    /* Anonymous shared memory is inherited by the children; the
+     * cleanup registered by apr_shm_create() releases it when p is
+     * cleared at restart.
+     */
+    rv = apr_shm_create(&shm, sizeof(ctstats_table), NULL, p);
+    if (rv == APR_SUCCESS) {
+        stats = apr_shm_baseaddr_get(shm);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "can't create shared memory for CT statistics; "
+                     "statistics will be maintained separately by each "
+                     "child process");
+        stats = apr_palloc(p, sizeof(ctstats_table));
+    }
+
+    memset(stats, 0, sizeof(ctstats_table));
+    stats->started = apr_time_now();
+}
+
+static ctstats_backend *find_backend(const char *name)
+{
+    int i;
+
+    for (i = 0; i < CTSTATS_MAX_BACKENDS; i++) {
+        ctstats_backend *b = &stats->backends[i];
+        apr_uint32_t state = apr_atomic_read32(&b->state);
+
+        if (state == SLOT_FREE) {
+            if (apr_atomic_cas32(&b->state, SLOT_CLAIMED,
+                                 SLOT_FREE) == SLOT_FREE) {
+                apr_cpystrn(b->name, name, sizeof b->name);
+                apr_atomic_set32(&b->state, SLOT_READY);
+                return b;
+            }
+            state = apr_atomic_read32(&b->state);
+        }
+
+        if (state == SLOT_READY && !strcmp(b->name, name)) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static ctstats_log *find_log(const unsigned char *log_id)
+{
+    int i;
+
+    for (i = 0; i < CTSTATS_MAX_LOGS; i++) {
+        ctstats_log *l = &stats->logs[i];
+        apr_uint32_t state = apr_atomic_read32(&l->state);
+
+        if (state == SLOT_FREE) {
+            if (apr_atomic_cas32(&l->state, SLOT_CLAIMED,
+                                 SLOT_FREE) == SLOT_FREE) {
+                memcpy(l->log_id, log_id, LOG_ID_SIZE);
+                apr_atomic_set32(&l->state, SLOT_READY);
+                return l;
+            }
+            state = apr_atomic_read32(&l->state);
+        }
+
+        if (state == SLOT_READY && !memcmp(l->log_id, log_id, LOG_ID_SIZE)) {
+            return l;
+        }
+    }
+
+    return NULL;
+}
+
+void ctstats_backend_handshake(conn_rec *c, int sources, int cache_hit,
+                               apr_size_t sct_bytes, int validation_failure)
+{
+    char name[CTSTATS_NAME_LEN];
+    ctstats_backend *b;
+
+    if (!stats) {
+        return;
+    }
+
+    /* c is the connection to the backend, so the "client" address is
+     * the address of the backend server
+     */
+    apr_snprintf(name, sizeof name, "%pI", c->client_addr);
+
+    b = find_backend(name);
+    if (!b) {
+        counter_add(&stats->backend_overflow, 1);
+        return;
+    }
+
+    counter_add(&b->handshakes, 1);
+    if (cache_hit) {
+        counter_add(&b->cache_hits, 1);
+    }
+    if (!sources) {
+        counter_add(&b->no_scts, 1);
+    }
+    if (sources & CTSTATS_SRC_CERTEXT) {
+        counter_add(&b->certext, 1);
+    }
+    if (sources & CTSTATS_SRC_TLSEXT) {
+        counter_add(&b->tlsext, 1);
+    }
+    if (sources & CTSTATS_SRC_OCSP) {
+        counter_add(&b->ocsp, 1);
+    }
+    if (validation_failure) {
+        counter_add(&b->validation_failures, 1);
+    }
+    if (sct_bytes) {
+        counter_add(&b->sct_bytes, (apr_uint32_t)sct_bytes);
+    }
+}
+
+void ctstats_log_sct(const unsigned char *log_id, int result)
+{
+    ctstats_log *l;
+
+    if (!stats) {
+        return;
+    }
+
+    ap_assert(result >= 0 && result < CTSTATS_SCT_NUM_RESULTS);
+
+    l = find_log(log_id);
+    if (!l) {
+        counter_add(&stats->log_overflow, 1);
+        return;
+    }
+
+    counter_add(&l->scts[result], 1);
+}
+
+int ctstats_status_hook(request_rec *r, int flags)
+{
+    char started[APR_RFC822_DATE_LEN];
+    int i;
+
+    if (!stats) {
+        return OK;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        for (i = 0; i < CTSTATS_MAX_BACKENDS; i++) {
+            ctstats_backend *b = &stats->backends[i];
+
+            if (apr_atomic_read32(&b->state) != SLOT_READY) {
+                continue;
+            }
+            ap_rprintf(r, "CTBackend: %s handshakes=%" APR_UINT64_T_FMT
+                       " cachehits=%" APR_UINT64_T_FMT
+                       " noscts=%" APR_UINT64_T_FMT
+                       " certext=%" APR_UINT64_T_FMT
+                       " tlsext=%" APR_UINT64_T_FMT
+                       " ocsp=%" APR_UINT64_T_FMT
+                       " failures=%" APR_UINT64_T_FMT
+                       " sctbytes=%" APR_UINT64_T_FMT "\n",
+                       b->name,
+                       counter_read(&b->handshakes),
+                       counter_read(&b->cache_hits),
+                       counter_read(&b->no_scts),
+                       counter_read(&b->certext),
+                       counter_read(&b->tlsext),
+                       counter_read(&b->ocsp),
+                       counter_read(&b->validation_failures),
+                       counter_read(&b->sct_bytes));
+        }
+        for (i = 0; i < CTSTATS_MAX_LOGS; i++) {
+            ctstats_log *l = &stats->logs[i];
+
+            if (apr_atomic_read32(&l->state) != SLOT_READY) {
+                continue;
+            }
+            ap_rprintf(r, "CTLog: %s valid=%" APR_UINT64_T_FMT
+                       " invalid=%" APR_UINT64_T_FMT
+                       " unknown=%" APR_UINT64_T_FMT "\n",
+                       apr_pescape_hex(r->pool, l->log_id, LOG_ID_SIZE, 0),
+                       counter_read(&l->scts[CTSTATS_SCT_VALID]),
+                       counter_read(&l->scts[CTSTATS_SCT_INVALID]),
+                       counter_read(&l->scts[CTSTATS_SCT_UNKNOWN_LOG]));
+        }
+        ap_rprintf(r, "CTBackendOverflow: %" APR_UINT64_T_FMT "\n",
+                   counter_read(&stats->backend_overflow));
+        ap_rprintf(r, "CTLogOverflow: %" APR_UINT64_T_FMT "\n",
+                   counter_read(&stats->log_overflow));
+        return OK;
+    }
+
+    apr_rfc822_date(started, stats->started);
+
+    ap_rputs("<hr>\n<h2>Certificate Transparency (proxy)</h2>\n", r);
+    ap_rprintf(r, "<p>Statistics since %s</p>\n", started);
+
+    ap_rputs("<table border=\"1\">\n"
+             "<tr><th>Backend</th><th>Handshakes</th><th>Cache hits</th>"
+             "<th>No SCTs</th><th>Cert ext</th><th>TLS ext</th>"
+             "<th>OCSP</th><th>Validation failures</th>"
+             "<th>SCT bytes</th></tr>\n", r);
+    for (i = 0; i < CTSTATS_MAX_BACKENDS; i++) {
+        ctstats_backend *b = &stats->backends[i];
+
+        if (apr_atomic_read32(&b->state) != SLOT_READY) {
+            continue;
+        }
+        ap_rprintf(r, "<tr><td>%s</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td></tr>\n",
+                   ap_escape_html(r->pool, b->name),
+                   counter_read(&b->handshakes),
+                   counter_read(&b->cache_hits),
+                   counter_read(&b->no_scts),
+                   counter_read(&b->certext),
+                   counter_read(&b->tlsext),
+                   counter_read(&b->ocsp),
+                   counter_read(&b->validation_failures),
+                   counter_read(&b->sct_bytes));
+    }
+    ap_rputs("</table>\n", r);
+    if (counter_read(&stats->backend_overflow)) {
+        ap_rprintf(r, "<p>%" APR_UINT64_T_FMT " handshakes with backends beyond the first %d "
+                   "were not tracked</p>\n",
+                   counter_read(&stats->backend_overflow),
+                   CTSTATS_MAX_BACKENDS);
+    }
+
+    ap_rputs("<table border=\"1\">\n"
+             "<tr><th>Log id</th><th>Valid SCTs</th><th>Invalid SCTs</th>"
+             "<th>Unknown log</th></tr>\n", r);
+    for (i = 0; i < CTSTATS_MAX_LOGS; i++) {
+        ctstats_log *l = &stats->logs[i];
+
+        if (apr_atomic_read32(&l->state) != SLOT_READY) {
+            continue;
+        }
+        ap_rprintf(r, "<tr><td><code>%s</code></td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td></tr>\n",
+                   apr_pescape_hex(r->pool, l->log_id, LOG_ID_SIZE, 0),
+                   counter_read(&l->scts[CTSTATS_SCT_VALID]),
+                   counter_read(&l->scts[CTSTATS_SCT_INVALID]),
+                   counter_read(&l->scts[CTSTATS_SCT_UNKNOWN_LOG]));
+    }
+    ap_rputs("</table>\n", r);
+    if (counter_read(&stats->log_overflow)) {
+        ap_rprintf(r, "<p>%" APR_UINT64_T_FMT " SCTs from logs beyond the first %d "
+                   "were not tracked</p>\n",
+                   counter_read(&stats->log_overflow),
+                   CTSTATS_MAX_LOGS);
+    }
+
+    return OK;
+}
@@ -0,0 +1,42 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SSL_CT_STATS_H
+#define SSL_CT_STATS_H
+
+#include "httpd.h"
+
+/* where the SCTs from a backend server were found (bit mask) */
+#define CTSTATS_SRC_CERTEXT  0x01
+#define CTSTATS_SRC_TLSEXT   0x02
+#define CTSTATS_SRC_OCSP     0x04
+
+/* result of on-line verification of a single SCT */
+#define CTSTATS_SCT_VALID       0
+#define CTSTATS_SCT_INVALID     1
+#define CTSTATS_SCT_UNKNOWN_LOG 2
+#define CTSTATS_SCT_NUM_RESULTS 3
+
+void ctstats_init(apr_pool_t *p, server_rec *s);
+
+void ctstats_backend_handshake(conn_rec *c, int sources, int cache_hit,
+                               apr_size_t sct_bytes, int validation_failure);
+
+void ctstats_log_sct(const unsigned char *log_id, int result);
+
+int ctstats_status_hook(request_rec *r, int flags);
+
+#endif /* SSL_CT_STATS_H */
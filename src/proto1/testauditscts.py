@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import imp
+import os
+import struct
+import sys
+import unittest
+
+sys.dont_write_bytecode = True  # wonky since no .py extension
+sys.path.append('.')
+imp.load_source("ctauditscts", "ctauditscts")
+import ctauditscts
+
+keys_fn = '/tmp/test_audited.keys'
+audit_fn = '/tmp/test_audit.out'
+
+
+def server_data(key, log_ids):
+    """Build the data httpd saves for audit from one server."""
+    cert = '\x30\x03\x02\x01\x01'
+    data = struct.pack('>HHH', ctauditscts.SERVER_START,
+                       ctauditscts.KEY_START, len(key)) + key
+    data += struct.pack('>H', ctauditscts.CERT_START)
+    data += struct.pack('>BBB', 0, 0, len(cert)) + cert
+    for i, log_id in enumerate(log_ids):
+        sct = '\x00' + log_id + struct.pack('>Q', 1000 + i)
+        data += struct.pack('>HH', ctauditscts.SCT_START, len(sct)) + sct
+    return data
+
+
+class TestAuditedKeys(unittest.TestCase):
+
+    def setUp(self):
+        if os.path.exists(keys_fn):
+            os.unlink(keys_fn)
+
+    def tearDown(self):
+        if os.path.exists(keys_fn):
+            os.unlink(keys_fn)
+
+    def test_missing_file(self):
+        self.assertEqual(ctauditscts.read_audited_keys(keys_fn), set())
+
+    def test_round_trip(self):
+        key_1 = 'c0fe' * 16
+        key_2 = '0123' * 16
+        key_3 = 'ffff' * 16
+        ctauditscts.write_audited_keys(keys_fn, [key_1, key_2, key_3])
+        self.assertEqual(os.path.getsize(keys_fn), 3 * ctauditscts.KEY_SIZE)
+        self.assertFalse(os.path.exists(keys_fn + '.tmp'))
+
+        # httpd does a binary search, so the keys must be sorted
+        data = open(keys_fn, 'rb').read()
+        self.assertEqual(data[:2], '\x01\x23')
+        self.assertEqual(data[32:34], '\xc0\xfe')
+        self.assertEqual(data[64:66], '\xff\xff')
+
+        keys = ctauditscts.read_audited_keys(keys_fn)
+        self.assertEqual(keys, set([key_1, key_2, key_3]))
+
+        # merge with keys from a later audit
+        key_4 = '4567' * 16
+        ctauditscts.write_audited_keys(keys_fn, keys | set([key_4]))
+        keys = ctauditscts.read_audited_keys(keys_fn)
+        self.assertEqual(keys, set([key_1, key_2, key_3, key_4]))
+
+    def test_bad_keys_skipped(self):
+        key_1 = 'c0fe' * 16
+        ctauditscts.write_audited_keys(keys_fn, [key_1, 'xyz', 'c0fe'])
+        keys = ctauditscts.read_audited_keys(keys_fn)
+        self.assertEqual(keys, set([key_1]))
+
+    def test_corrupt_file(self):
+        with open(keys_fn, 'wb') as f:
+            f.write('\x00' * (ctauditscts.KEY_SIZE + 1))
+        self.assertEqual(ctauditscts.read_audited_keys(keys_fn), set())
+
+    def test_too_many_keys(self):
+        key_1 = 'c0fe' * 16
+        key_2 = '0123' * 16
+        key_3 = 'ffff' * 16
+        max_keys = ctauditscts.MAX_AUDITED_KEYS
+        ctauditscts.MAX_AUDITED_KEYS = 2
+        try:
+            ctauditscts.write_audited_keys(keys_fn, [key_1, key_2, key_3],
+                                           [key_3])
+        finally:
+            ctauditscts.MAX_AUDITED_KEYS = max_keys
+        keys = ctauditscts.read_audited_keys(keys_fn)
+        self.assertEqual(len(keys), 2)
+        self.assertTrue(key_3 in keys)
+
+
+class TestAudit(unittest.TestCase):
+
+    def setUp(self):
+        self.verify_sct = ctauditscts.verify_sct
+        self.verified = []
+        self.bad_log_ids = set()
+
+        def verify_sct(leaf_pem_fn, log_id, timestamp_ms, cur):
+            self.verified.append(log_id)
+            return log_id not in self.bad_log_ids
+
+        ctauditscts.verify_sct = verify_sct
+
+    def tearDown(self):
+        ctauditscts.verify_sct = self.verify_sct
+        if os.path.exists(audit_fn):
+            os.unlink(audit_fn)
+
+    def run_audit(self, data, already_checked, failed):
+        with open(audit_fn, 'wb') as f:
+            f.write(data)
+        return ctauditscts.audit(audit_fn, '/tmp', already_checked, failed,
+                                 None)
+
+    def test_all_scts_verified(self):
+        key_1 = 'c0fe' * 16
+        key_2 = '0123' * 16
+        log_1 = '\x01' * 32
+        log_2 = '\x02' * 32
+        self.bad_log_ids.add(log_2)
+        already_checked = {}
+        failed = set()
+        keys = self.run_audit(server_data(key_1, [log_1, log_1]) +
+                              server_data(key_2, [log_1, log_2, log_1]),
+                              already_checked, failed)
+        self.assertEqual(keys, set([key_1, key_2]))
+        # every SCT is checked, even after one fails
+        self.assertEqual(self.verified, [log_1, log_1, log_1, log_2, log_1])
+        # only data whose SCTs were all verified counts as audited
+        self.assertEqual(already_checked.keys(), [key_1])
+        self.assertEqual(failed, set([key_2]))
+
+    def test_skip_already_checked(self):
+        key_1 = 'c0fe' * 16
+        key_2 = '0123' * 16
+        log_1 = '\x01' * 32
+        self.bad_log_ids.add(log_1)
+        already_checked = {key_1: True}
+        failed = set([key_2])
+        self.run_audit(server_data(key_1, [log_1]) +
+                       server_data(key_2, [log_1]),
+                       already_checked, failed)
+        self.assertEqual(self.verified, [])
+        self.assertEqual(already_checked.keys(), [key_1])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -15,6 +15,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import binascii
+import hashlib
 import imp
 import os
 import sqlite3
@@ -27,10 +29,16 @@ imp.load_source("ctlogconfig", "ctlogconfig")
 import ctlogconfig
 
 db_name = '/tmp/test_db'
+der_key_file = '/tmp/test-public-key.der'
 public_key_file_1 = 'test-public-key-1.pem'
 public_key_file_2 = 'test-public-key-2.pem'
 
 
+def der_and_log_id(pem_file):
+    der = ctlogconfig.read_public_key(pem_file)
+    return der, hashlib.sha256(der).hexdigest().upper()
+
+
 class TestConfigCommand(unittest.TestCase):
 
     def setUp(self):
@@ -91,24 +99,28 @@ class TestConfigCommand(unittest.TestCase):
         self.assertEqual(rec.url, test_url_1)
 
         # ctauditscts should be able to query it like this:
-        stmt = 'SELECT * FROM loginfo WHERE log_id = ?'
-        self.cur.execute(stmt, [log_id_1])
+        stmt = 'SELECT * FROM loginfo WHERE log_id = ? OR log_id = ?'
+        self.cur.execute(stmt, [log_id_1,
+                                sqlite3.Binary(binascii.unhexlify(log_id_1))])
         recs = list(self.cur.fetchall())
         self.assertEqual(len(recs), 1)
         rec = recs[0]
-        self.assertEqual(rec[1], log_id_1)
+        self.assertEqual(binascii.hexlify(rec[1]).upper(), log_id_1)
         self.assertEqual(rec[6], test_url_1)
 
     def test_key_configuration(self):
-        # 1. Configure public key (new entry)
+        der_1, log_id_1 = der_and_log_id(public_key_file_1)
+        der_2, log_id_2 = der_and_log_id(public_key_file_2)
+
+        # 1. Configure public key (new entry); the log id is computed
         ctlogconfig.configure_public_key(self.cur,
                                          [public_key_file_1])
         recs = ctlogconfig.dump_ll(self.cur)
         self.assertEqual(len(recs), 1)
         rec = recs[0]
         self.assertEqual(rec.id, 1)
-        self.assertEqual(rec.log_id, None)
-        self.assertEqual(rec.public_key, public_key_file_1)
+        self.assertEqual(rec.log_id, log_id_1)
+        self.assertEqual(rec.public_key, der_1)
         self.assertEqual(rec.distrusted, None)
         self.assertEqual(rec.min_valid_timestamp, None)
         self.assertEqual(rec.max_valid_timestamp, None)
@@ -120,7 +132,59 @@ class TestConfigCommand(unittest.TestCase):
         self.assertEqual(len(recs), 1)
         rec = recs[0]
         self.assertEqual(rec.id, 1)
-        self.assertEqual(rec.public_key, public_key_file_2)
+        self.assertEqual(rec.log_id, log_id_2)
+        self.assertEqual(rec.public_key, der_2)
+
+    def test_der_key_configuration(self):
+        der_1, log_id_1 = der_and_log_id(public_key_file_1)
+        with open(der_key_file, 'wb') as f:
+            f.write(der_1)
+        try:
+            ctlogconfig.configure_public_key(self.cur, [der_key_file])
+        finally:
+            os.unlink(der_key_file)
+        recs = ctlogconfig.dump_ll(self.cur)
+        self.assertEqual(len(recs), 1)
+        self.assertEqual(recs[0].log_id, log_id_1)
+        self.assertEqual(recs[0].public_key, der_1)
+
+    def test_key_for_log_id(self):
+        der_1, log_id_1 = der_and_log_id(public_key_file_1)
+        ctlogconfig.distrust_log(self.cur, [log_id_1])
+        ctlogconfig.configure_public_key(self.cur,
+                                         ['#1', public_key_file_1])
+        recs = ctlogconfig.dump_ll(self.cur)
+        self.assertEqual(len(recs), 1)
+        self.assertEqual(recs[0].log_id, log_id_1)
+        self.assertEqual(recs[0].public_key, der_1)
+        self.assertEqual(recs[0].distrusted, 1)
+
+        # a key which doesn't match the configured log id is rejected
+        ctlogconfig.distrust_log(self.cur, ['C0FE' * 16])
+        with self.assertRaises(SystemExit):
+            ctlogconfig.configure_public_key(self.cur,
+                                             ['#2', public_key_file_1])
+
+    def test_operator(self):
+        log_id_1 = 'C0FE' * 16
+        ctlogconfig.configure_operator(self.cur, [log_id_1, 'Example'])
+        ctlogconfig.configure_operator(self.cur, ['#1', 'Example 2'])
+        recs = ctlogconfig.dump_ll(self.cur)
+        self.assertEqual(len(recs), 1)
+        self.assertEqual(recs[0].log_id, log_id_1)
+        self.assertEqual(recs[0].operator, 'Example 2')
+
+    def test_config_version(self):
+        log_id_1 = 'C0FE' * 16
+        self.assertEqual(ctlogconfig.schema_version(self.cur),
+                         ctlogconfig.SCHEMA_VERSION)
+        version = ctlogconfig.config_version(self.cur)
+        ctlogconfig.trust_log(self.cur, [log_id_1])
+        self.assertEqual(ctlogconfig.config_version(self.cur), version + 1)
+        ctlogconfig.distrust_log(self.cur, ['#1'])
+        self.assertEqual(ctlogconfig.config_version(self.cur), version + 2)
+        ctlogconfig.forget_log(self.cur, ['#1'])
+        self.assertEqual(ctlogconfig.config_version(self.cur), version + 3)
 
     def test_forget(self):
         log_id_1 = 'C0FE' * 16
@@ -197,5 +261,81 @@ class TestConfigCommand(unittest.TestCase):
         self.assertEqual(rec.url, None)
 
 
+class TestUpgrade(unittest.TestCase):
+
+    def setUp(self):
+        if os.path.exists(db_name):
+            os.unlink(db_name)
+        # schema version 1, as created by earlier versions of ctlogconfig
+        self.cxn = sqlite3.connect(db_name)
+        self.cur = self.cxn.cursor()
+        self.cur.execute(
+            'CREATE TABLE loginfo('
+            + 'id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, '
+            + 'log_id TEXT, '
+            + 'public_key TEXT, '
+            + 'distrusted INTEGER, '
+            + 'min_valid_timestamp INTEGER, '
+            + 'max_valid_timestamp INTEGER, '
+            + 'url TEXT)'
+        )
+        self.assertEqual(ctlogconfig.schema_version(self.cur), 1)
+
+    def tearDown(self):
+        self.cur.close()
+        self.cxn.close()
+
+    def test_upgrade(self):
+        der_1, log_id_1 = der_and_log_id(public_key_file_1)
+        der_2, log_id_2 = der_and_log_id(public_key_file_2)
+        log_id_3 = 'C0FE' * 16
+        stmt = 'INSERT INTO loginfo (log_id, public_key, distrusted, ' + \
+               'url) VALUES(?, ?, ?, ?)'
+        self.cur.executemany(stmt, [
+            [None, public_key_file_1, None, 'http://log1.example.com/'],
+            [log_id_2, public_key_file_2, 1, None],
+            [log_id_3, None, None, 'http://log3.example.com/'],
+        ])
+        self.cur.execute('DELETE FROM loginfo WHERE id = 1')
+        self.cur.execute('INSERT INTO loginfo (url) VALUES(?)',
+                         ['http://log4.example.com/'])
+        self.cxn.commit()
+
+        ctlogconfig.upgrade(self.cur, [])
+
+        self.assertEqual(ctlogconfig.schema_version(self.cur),
+                         ctlogconfig.SCHEMA_VERSION)
+        recs = ctlogconfig.dump_ll(self.cur)
+        self.assertEqual(len(recs), 3)
+        self.assertEqual([rec.id for rec in recs], [2, 3, 4])
+        self.assertEqual(recs[0].log_id, log_id_2)
+        self.assertEqual(recs[0].public_key, der_2)
+        self.assertEqual(recs[0].distrusted, 1)
+        self.assertEqual(recs[1].log_id, log_id_3)
+        self.assertEqual(recs[1].public_key, None)
+        self.assertEqual(recs[1].url, 'http://log3.example.com/')
+        self.assertEqual(recs[2].log_id, None)
+        self.assertEqual(recs[2].operator, None)
+
+        # record ids keep increasing, and changes bump the config version
+        version = ctlogconfig.config_version(self.cur)
+        ctlogconfig.configure_public_key(self.cur, [public_key_file_1])
+        recs = ctlogconfig.dump_ll(self.cur)
+        self.assertEqual(recs[-1].id, 5)
+        self.assertEqual(recs[-1].log_id, log_id_1)
+        self.assertEqual(ctlogconfig.config_version(self.cur), version + 1)
+
+    def test_upgrade_missing_key_file(self):
+        self.cur.execute('INSERT INTO loginfo (public_key) VALUES(?)',
+                         ['/nonexistent/key.pem'])
+        self.cxn.commit()
+        with self.assertRaises(SystemExit):
+            ctlogconfig.upgrade(self.cur, [])
+        # nothing was changed
+        self.assertEqual(ctlogconfig.schema_version(self.cur), 1)
+        self.cur.execute('SELECT public_key FROM loginfo')
+        self.assertEqual(self.cur.fetchall(), [('/nonexistent/key.pem',)])
+
+
 if __name__ == '__main__':
     unittest.main()